@@ -31,6 +31,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <errno.h>
 
@@ -42,11 +43,27 @@
 #include <jack/ringbuffer.h>
 
 #include "ao_jack_resample.h"
+#include "ao_jack_trace.h"
 
 #define MAX_PORT_NAME_LEN (6 + 8)
 
 #define INPUT_BUFFER_SIZE (10 * 1024 * sizeof(float))
 
+/* number of frames an input buffer can always hold */
+#define INPUT_BUFFER_FRAMES (INPUT_BUFFER_SIZE / sizeof(float) - 1)
+
+/* raw PCM queued by ao_plugin_play in asynchronous mode */
+#define STAGING_BUFFER_SIZE (64 * 1024)
+
+/* maximum number of raw bytes converted at once by the worker thread */
+#define STAGING_CHUNK_SIZE (16 * 1024)
+
+/* values deinterleaved at once, source and destination tiles fit in L1 */
+#define DEINTERLEAVE_TILE_SIZE (2 * 1024)
+
+/* number of written chunks whose position can be tracked by the clock */
+#define CLOCK_CHUNKS 1024
+
 #define CLIENT_NAME "aojack"
 
 typedef jack_default_audio_sample_t sample_t;
@@ -54,14 +71,23 @@ typedef jack_default_audio_sample_t sample_t;
 #define aojdebug(format, args...) do { fprintf(stderr,"ao_jack debug: " format,## args); } while(0 == 1)
 
 static char *ao_jack_options[] = {
+        "async",
         "client_name",
+        "coalesce",
 	"dev",
         "debug",
+        "fast_start",
+        "gain",
+        "gain_ramp",
+        "idle_cycles",
+        "idle_deactivate",
 	"id",
         "matrix",
         "ports",
+        "prebuffer",
         "quality",
         "quiet",
+        "resample_threads",
         "verbose",
 };
 
@@ -79,6 +105,33 @@ static ao_info ao_jack_info = {
 };
 
 
+/**
+ * Mapping between input frames and output frames for a written chunk
+ */
+typedef struct aojack_clock_chunk_t
+{
+	uint64_t input_start;
+	uint64_t output_start;
+	size_t input_frames;
+	size_t output_frames;
+} aojack_clock_chunk_t;
+
+/**
+ * Input frame audible at a given JACK frame time
+ */
+typedef struct aojack_clock_t
+{
+	int valid;
+	uint64_t input_frame;
+	jack_nframes_t frame_time;
+	/* number of frames played from this point */
+	jack_nframes_t nframes;
+	/* number of input frames by output frame */
+	double ratio;
+} aojack_clock_t;
+
+typedef void (*aojack_deinterleave_t)(size_t nchannels, size_t nframes, const float *source, float *destination);
+
 typedef struct ao_jack_internal
 {
 	jack_client_t *client;
@@ -87,24 +140,114 @@ typedef struct ao_jack_internal
 	int input_rate;
 	int output_rate;
 	unsigned long quality;
+	size_t resample_threads;
+
+	/* gain applied during the conversion, the target is set by any thread */
+	float gain_target;
+	unsigned long gain_ramp_ms;
+	size_t gain_ramp_frames;
+	/* set by JACK on underrun, the next frames written in the input buffers fade in */
+	int declick;
+	size_t declick_frames;
+	size_t declick_left;
+	/* state of the converting thread */
+	float gain;
+	float gain_step;
+	float gain_ramp_target;
+	size_t gain_ramp_left;
 
 	size_t bits;
+	size_t nchannels;
 
 	size_t nports;
 	char **port_names;
+	char **destination_ports;
 	jack_port_t **output_ports;
 	jack_ringbuffer_t **input_channels;
 
 	aojack_resampler_t *resampler;
+	aojack_deinterleave_t deinterleave;
+
+	/* buffers kept between calls, only reallocated to grow */
+	float *convert_buffer;
+	size_t convert_frames;
+	float *deinterleave_buffer;
+	size_t deinterleave_frames;
+
+	/* small writes are gathered as raw samples until coalesce_frames are available */
+	unsigned long coalesce;
+	size_t coalesce_frames;
+	size_t coalesce_fill;
+	char *coalesce_buffer;
+	/* they are flushed when less than a JACK period is queued */
+	size_t coalesce_low;
 
 	/* synchronization when the input buffer is full */
 	pthread_mutex_t input_mutex;
 	pthread_cond_t input_cond;
+
+	/* asynchronous mode: ao_plugin_play only queues the raw samples in
+	 * the staging buffer and the worker thread converts them */
+	int async;
+	jack_ringbuffer_t *staging;
+	char *worker_buffer;
+	pthread_t worker;
+	int worker_running;
+	int worker_stop;
+	int worker_status;
+	pthread_mutex_t staging_mutex;
+	pthread_cond_t staging_data_cond;
+	pthread_cond_t staging_space_cond;
+
+	/* playback clock, the chunks are written by the producer and read by JACK */
+	jack_ringbuffer_t *clock_chunks;
+	uint64_t input_frames_written;
+	uint64_t output_frames_written;
+	aojack_clock_chunk_t clock_chunk;
+	int has_clock_chunk;
+	uint64_t output_frames_played;
+	/* snapshot published by JACK, odd sequence while it is updated */
+	unsigned long clock_sequence;
+	aojack_clock_t clock;
+
+	/* idle mode after idle_cycles periods without frames */
+	unsigned long idle_cycles;
+	unsigned long empty_cycles;
+	int idle;
+	/* in idle mode, the client is deactivated by the idle thread */
+	int idle_deactivate;
+	int deactivation_requested;
+	/* set by JACK on underrun while frames are coalesced */
+	int flush_requested;
+	int deactivated;
+	/* threads writing frames, the client is not deactivated meanwhile */
+	int playing;
+	pthread_t idle_thread;
+	int idle_thread_running;
+	int idle_stop;
+	pthread_mutex_t idle_mutex;
+	pthread_cond_t idle_cond;
+
+	/* output stays silent until prebuffer_frames are queued */
+	unsigned long prebuffer;
+	int prebuffer_in_ms;
+	size_t prebuffer_frames;
+	size_t prebuffer_waited;
+	int started;
+	/* with fast_start, the producer estimates the frames needed */
+	int fast_start;
+	size_t fast_start_frames;
+	/* frames written since the first write while not started */
+	jack_time_t producer_start;
+	uint64_t producer_frames;
+	unsigned long producer_writes;
 } ao_jack_internal;
 
 
 static int jack_shutdown = 0;
 
+AOJACK_TRACE_DEFINE_SEMAPHORES
+
 /**
  * Called by JACK on error
  */
@@ -118,7 +261,13 @@ static void on_jack_error(const char *msg)
  */
 static void on_jack_shutdown(void *arg)
 {
+	ao_jack_internal *internal = (ao_jack_internal*)arg;
 	jack_shutdown = 1;
+	/* wake up a producer waiting for JACK to consume frames */
+	if (pthread_mutex_lock(&(internal->input_mutex)) == 0) {
+		pthread_cond_signal(&(internal->input_cond));
+		pthread_mutex_unlock(&(internal->input_mutex));
+	}
 }
 
 /**
@@ -150,6 +299,31 @@ static char **parse_comma_separated_option(char *option)
 	return result;
 }
 
+/**
+ * Return true if the option value means yes
+ */
+static int parse_boolean_option(const char *value)
+{
+	return (strcmp(value, "yes") == 0 || strcmp(value, "y") == 0 ||
+		strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+}
+
+/**
+ * Copy a NULL terminated array of strings
+ */
+static char **copy_string_array(const char **array)
+{
+	size_t size, i;
+	char **result;
+	for (size = 0; array[size]; size++);
+	result = calloc(size + 1, sizeof(char *));
+	if (result) {
+		for (i = 0; i < size; i++)
+			result[i] = strdup(array[i]);
+	}
+	return result;
+}
+
 /**
  * Free arrays allocated by `parse_comma_separated_option'
  */
@@ -180,14 +354,52 @@ static int on_sample_rate_update(jack_nframes_t new_rate, void *arg)
 	return 0;
 }
 
+static void stop_async_worker(ao_jack_internal *internal);
+static void stop_idle_thread(ao_jack_internal *internal);
+static int flush_samples(ao_jack_internal *internal);
+static void drain_input_channels(ao_jack_internal *internal);
+static int begin_play(ao_jack_internal *internal);
+static void end_play(ao_jack_internal *internal);
+
+/**
+ * Connect the output ports to their destination
+ */
+static int connect_ports(ao_jack_internal *internal)
+{
+	int status = 0;
+	size_t i;
+	for (i = 0; status == 0 && i < internal->nports; i++) {
+		const char *port_name = jack_port_name(internal->output_ports[i]);
+		const char *destination = internal->destination_ports[i];
+		adebug("connecting %s to %s\n", port_name, destination);
+		status = jack_connect(internal->client, port_name, destination);
+		if (status == EEXIST) {
+			aerror("%s: port %s is already connected\n", internal->client_name, port_name);
+		} else if (status != 0) {
+			aerror("%s: can't connect port %s (code: %d)\n", internal->client_name, port_name, status);
+		}
+	}
+	return status;
+}
+
 /**
  * Close and release all resources allocated to open the client
  */
 static void close_internal(ao_jack_internal *internal)
 {
+	stop_async_worker(internal);
+	if (internal->client && !jack_shutdown) {
+		/* the idle thread must not flush or deactivate meanwhile */
+		if (begin_play(internal) == 0 && flush_samples(internal) == 0)
+			drain_input_channels(internal);
+		end_play(internal);
+	}
+	stop_idle_thread(internal);
 	if (internal->client) {
 		jack_client_t *client = internal->client;
 		size_t i;
+		/* JACK must not read the input buffers anymore */
+		jack_deactivate(client);
 		if (internal->output_ports) {
 			for (i = 0; i < internal->nports; i++) {
 				jack_port_unregister(client, internal->output_ports[i]);
@@ -202,10 +414,27 @@ static void close_internal(ao_jack_internal *internal)
 			free(internal->input_channels);
 			internal->input_channels = NULL;
 		}
+		internal->nports = 0;
 		internal->client = NULL;
-		jack_deactivate(client);
 		jack_client_close(client);
 	}
+	free_string_array(internal->destination_ports);
+	internal->destination_ports = NULL;
+	if (internal->clock_chunks) {
+		jack_ringbuffer_free(internal->clock_chunks);
+		internal->clock_chunks = NULL;
+	}
+	aojack_delete_resampler(internal->resampler);
+	internal->resampler = NULL;
+	free(internal->convert_buffer);
+	internal->convert_buffer = NULL;
+	internal->convert_frames = 0;
+	free(internal->deinterleave_buffer);
+	internal->deinterleave_buffer = NULL;
+	internal->deinterleave_frames = 0;
+	free(internal->coalesce_buffer);
+	internal->coalesce_buffer = NULL;
+	internal->coalesce_fill = 0;
 }
 
 
@@ -213,76 +442,471 @@ static void close_internal(ao_jack_internal *internal)
  * Frame processing
  */
 
-static void array_uint8_to_float(const char *src, float *dest, size_t nvalues)
+/*
+ * The conversion kernels apply the gain while converting. The gain is
+ * incremented by step after each frame to apply linear ramps.
+ */
+
+static void array_uint8_to_float(const char *src, float *dest, size_t nframes, size_t nchannels, float gain, float step)
 {
-	const char *p;
-	size_t i;
-	for (i=0, p = src; i < nvalues; i++, p++)
-		dest[i] = (float)(*p) / 128.0f;
+	const char *p = src;
+	float scale = gain / 128.0f;
+	float scale_step = step / 128.0f;
+	size_t f, c;
+	for (f = 0; f < nframes; f++, scale += scale_step)
+		for (c = 0; c < nchannels; c++, p++, dest++)
+			*dest = (float)(*p) * scale;
 }
 
-static void array_uint16_to_float(const char *src, float *dest, size_t nvalues)
+static void array_uint16_to_float(const char *src, float *dest, size_t nframes, size_t nchannels, float gain, float step)
 {
-	const sint_16 *p;
-	size_t i;
-	for (i=0, p = (sint_16*)src; i < nvalues; i++, p++)
-		dest[i] = (float)(*p) / 32768.0f;
+	const sint_16 *p = (const sint_16 *)src;
+	float scale = gain / 32768.0f;
+	float scale_step = step / 32768.0f;
+	size_t f, c;
+	for (f = 0; f < nframes; f++, scale += scale_step)
+		for (c = 0; c < nchannels; c++, p++, dest++)
+			*dest = (float)(*p) * scale;
 }
 
-static float int24_to_float(sint_32 val)
+/* 24 bits samples are packed in 3 little endian bytes */
+static void array_uint24_to_float(const char *src, float *dest, size_t nframes, size_t nchannels, float gain, float step)
 {
-	static const sint_32 max24 = 4194304UL;
-	if (val >= max24)
-		val = -((val - 1) ^ 0xFFFFFF);
-	return (float)val/4194304.0f;
+	const unsigned char *p = (const unsigned char *)src;
+	float scale = gain / 8388608.0f;
+	float scale_step = step / 8388608.0f;
+	size_t f, c;
+	for (f = 0; f < nframes; f++, scale += scale_step) {
+		for (c = 0; c < nchannels; c++, p += 3, dest++) {
+			sint_32 value = (sint_32)p[0] | ((sint_32)p[1] << 8) | ((sint_32)(signed char)p[2] << 16);
+			*dest = (float)value * scale;
+		}
+	}
 }
 
-static void array_uint24_to_float(const char *src, float *dest, size_t nvalues)
+static void array_uint32_to_float(const char *src, float *dest, size_t nframes, size_t nchannels, float gain, float step)
 {
-	const sint_32 *p;
-	const char *q;
-	size_t i;
-	size_t nvalues4 = nvalues / 4 * 4;
-	for (i=0, p = (sint_32*)src; i < nvalues4; i+=4, p+=4) {
-		sint_32 a = *p;
-		sint_32 b = *(p+1);
-		sint_32 c = *(p+2);
-		dest[i] = int24_to_float((a & 0xFFFFFF00) >> 8);
-		dest[i+1] = int24_to_float(((a & 0xFF) << 16) + ((b & 0xFFFF0000) >> 16));
-		dest[i+2] = int24_to_float(((b & 0xFFFF) << 16) + ((c & 0xFF000000) >> 24));
-		dest[i+2] = int24_to_float(c & 0xFFFFFF);
-	}
-	q = (const char *)p;
-	if (nvalues4 + 1 <= nvalues) {
-		dest[i] = int24_to_float((((uint_32)*q) << 16) & (((uint_32)*(q+1)) << 8) & ((uint_32)*(q+2)));
-		if (nvalues4 + 2 <= nvalues) {
-			dest[i+1] = int24_to_float((((uint_32)*(q+3)) << 16) & (((uint_32)*(q+4)) << 8) & ((uint_32)*(q+5)));
-			if (nvalues4 + 3 <= nvalues) {
-				dest[i+2] = int24_to_float((((uint_32)*(q+6)) << 16) & (((uint_32)*(q+7)) << 8) & ((uint_32)*(q+8)));
+	const sint_32 *p = (const sint_32 *)src;
+	float scale = gain / 2147483648.0f;
+	float scale_step = step / 2147483648.0f;
+	size_t f, c;
+	for (f = 0; f < nframes; f++, scale += scale_step)
+		for (c = 0; c < nchannels; c++, p++, dest++)
+			*dest = (float)(*p) * scale;
+}
+
+/**
+ * Start a linear ramp from the current gain to the target
+ */
+static void start_gain_ramp(ao_jack_internal *internal, float target)
+{
+	internal->gain_ramp_target = target;
+	internal->gain_ramp_left = internal->gain_ramp_frames;
+	if (internal->gain_ramp_left > 0) {
+		internal->gain_step = (target - internal->gain) / internal->gain_ramp_left;
+	} else {
+		internal->gain = target;
+		internal->gain_step = 0.0f;
+	}
+}
+
+/**
+ * Convert interleaved samples to float and apply the gain
+ *
+ * A new target gain set by ao_plugin_jack_set_gain is reached with a
+ * ramp.
+ */
+static void convert_samples(ao_jack_internal *internal, const char *samples, float *data, size_t nframes)
+{
+	size_t nchannels = internal->nchannels;
+	size_t frame_size = nchannels * internal->bits / 8;
+	float target;
+
+	__atomic_load(&(internal->gain_target), &target, __ATOMIC_ACQUIRE);
+	if (target != internal->gain_ramp_target)
+		start_gain_ramp(internal, target);
+
+	while (nframes > 0) {
+		size_t n = nframes;
+		float step = 0.0f;
+		if (internal->gain_ramp_left > 0) {
+			if (n > internal->gain_ramp_left)
+				n = internal->gain_ramp_left;
+			step = internal->gain_step;
+		}
+
+		if (internal->bits == 8) {
+			array_uint8_to_float(samples, data, n, nchannels, internal->gain, step);
+		} else if (internal->bits == 16) {
+			array_uint16_to_float(samples, data, n, nchannels, internal->gain, step);
+		} else if (internal->bits == 24) {
+			array_uint24_to_float(samples, data, n, nchannels, internal->gain, step);
+		} else if (internal->bits == 32) {
+			array_uint32_to_float(samples, data, n, nchannels, internal->gain, step);
+		}
+
+		if (internal->gain_ramp_left > 0) {
+			internal->gain_ramp_left -= n;
+			if (internal->gain_ramp_left == 0)
+				internal->gain = internal->gain_ramp_target;
+			else
+				internal->gain += step * n;
+		}
+		samples += n * frame_size;
+		data += n * nchannels;
+		nframes -= n;
+	}
+}
+
+/************************************************************
+ * Playback clock
+ */
+
+/**
+ * Record the position of a chunk before it is written in the input buffers
+ *
+ * If the clock ring is full, the chunk is skipped and the position is
+ * extrapolated from the previous chunk until the next recorded one.
+ */
+static void record_clock_chunk(ao_jack_internal *internal, size_t input_frames, size_t nframes)
+{
+	aojack_clock_chunk_t chunk;
+	chunk.input_start = internal->input_frames_written;
+	chunk.output_start = internal->output_frames_written;
+	chunk.input_frames = input_frames;
+	chunk.output_frames = nframes;
+	if (nframes > 0 && jack_ringbuffer_write_space(internal->clock_chunks) >= sizeof(chunk))
+		jack_ringbuffer_write(internal->clock_chunks, (const char *)&chunk, sizeof(chunk));
+	internal->input_frames_written += input_frames;
+	internal->output_frames_written += nframes;
+}
+
+/**
+ * Publish the input frame audible when the current cycle is played
+ *
+ * Called by JACK before the frames are read. The ring fill is accounted
+ * for as only the frames actually read from the input buffers are
+ * counted.
+ */
+static void update_clock(ao_jack_internal *internal, jack_nframes_t nframes, size_t read_frames)
+{
+	aojack_clock_chunk_t *chunk = &(internal->clock_chunk);
+	aojack_clock_chunk_t next;
+	uint64_t position = internal->output_frames_played;
+	jack_latency_range_t latency;
+	aojack_clock_t clock;
+	double input_frame;
+
+	/* keep the current mapping until the position reaches the next chunk */
+	while (jack_ringbuffer_peek(internal->clock_chunks, (char *)&next, sizeof(next)) == sizeof(next)) {
+		if (internal->has_clock_chunk && position < next.output_start)
+			break;
+		jack_ringbuffer_read_advance(internal->clock_chunks, sizeof(next));
+		*chunk = next;
+		internal->has_clock_chunk = 1;
+	}
+	internal->output_frames_played += read_frames;
+	if (!internal->has_clock_chunk || read_frames == 0)
+		return;
+
+	/* frames of this cycle are played in the next one, after the port latency */
+	jack_port_get_latency_range(internal->output_ports[0], JackPlaybackLatency, &latency);
+	clock.valid = 1;
+	clock.ratio = (double)chunk->input_frames / (double)chunk->output_frames;
+	/* past the end of the chunk if the following ones were dropped */
+	input_frame = (double)chunk->input_start + (double)(int64_t)(position - chunk->output_start) * clock.ratio;
+	clock.input_frame = input_frame > 0 ? (uint64_t)input_frame : 0;
+	clock.frame_time = jack_last_frame_time(internal->client) + nframes + latency.max;
+	clock.nframes = read_frames;
+
+	__atomic_add_fetch(&(internal->clock_sequence), 1, __ATOMIC_ACQ_REL);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	internal->clock = clock;
+	__atomic_add_fetch(&(internal->clock_sequence), 1, __ATOMIC_RELEASE);
+}
+
+/************************************************************
+ * Idle mode
+ */
+
+/**
+ * Thread deactivating the client when JACK is idle
+ *
+ * Frames held in the coalesce buffer are flushed instead, and also when
+ * JACK runs out of frames. The producer is not writing as playing is zero.
+ */
+static void *idle_watcher(void *arg)
+{
+	ao_jack_internal *internal = (ao_jack_internal*)arg;
+	pthread_mutex_t *mutex_p = &(internal->idle_mutex);
+
+	pthread_mutex_lock(mutex_p);
+	for (;;) {
+		while (!internal->idle_stop && !internal->flush_requested
+		       && !(internal->deactivation_requested && !internal->deactivated))
+			pthread_cond_wait(&(internal->idle_cond), mutex_p);
+		if (internal->idle_stop)
+			break;
+		internal->flush_requested = 0;
+		if (internal->playing == 0 && internal->coalesce_fill > 0) {
+			if (flush_samples(internal) != 0)
+				adebug("%s: cannot flush coalesced frames\n", internal->client_name);
+			internal->deactivation_requested = 0;
+		} else if (internal->deactivation_requested && internal->idle && internal->idle_deactivate
+			   && internal->playing == 0 && jack_ringbuffer_read_space(internal->input_channels[0]) == 0) {
+			jack_deactivate(internal->client);
+			adebug("%s: client deactivated\n", internal->client_name);
+			/* the producer may be waiting for frames to be consumed */
+			pthread_mutex_lock(&(internal->input_mutex));
+			internal->deactivated = 1;
+			pthread_cond_signal(&(internal->input_cond));
+			pthread_mutex_unlock(&(internal->input_mutex));
+		} else
+			internal->deactivation_requested = 0;
+	}
+	pthread_mutex_unlock(mutex_p);
+	return NULL;
+}
+
+/**
+ * Start the thread deactivating the client
+ */
+static int start_idle_thread(ao_jack_internal *internal)
+{
+	internal->idle_stop = 0;
+	if (pthread_create(&(internal->idle_thread), NULL, idle_watcher, internal) != 0)
+		return 0;
+	internal->idle_thread_running = 1;
+	return 1;
+}
+
+/**
+ * Stop the thread deactivating the client
+ */
+static void stop_idle_thread(ao_jack_internal *internal)
+{
+	if (internal->idle_thread_running) {
+		pthread_mutex_lock(&(internal->idle_mutex));
+		internal->idle_stop = 1;
+		pthread_cond_signal(&(internal->idle_cond));
+		pthread_mutex_unlock(&(internal->idle_mutex));
+		pthread_join(internal->idle_thread, NULL);
+		internal->idle_thread_running = 0;
+	}
+}
+
+/**
+ * Called by JACK in idle mode, must not block
+ */
+static void request_deactivation(ao_jack_internal *internal)
+{
+	if (!internal->deactivation_requested && pthread_mutex_trylock(&(internal->idle_mutex)) == 0) {
+		internal->deactivation_requested = 1;
+		pthread_cond_signal(&(internal->idle_cond));
+		pthread_mutex_unlock(&(internal->idle_mutex));
+	}
+}
+
+/**
+ * Called by JACK on underrun while frames are coalesced, must not block
+ */
+static void request_flush(ao_jack_internal *internal)
+{
+	if (!internal->flush_requested && pthread_mutex_trylock(&(internal->idle_mutex)) == 0) {
+		internal->flush_requested = 1;
+		pthread_cond_signal(&(internal->idle_cond));
+		pthread_mutex_unlock(&(internal->idle_mutex));
+	}
+}
+
+/**
+ * Reactivate the client if it has been deactivated in idle mode
+ */
+static int resume_client(ao_jack_internal *internal)
+{
+	int status = 0;
+	if (internal->idle_thread_running) {
+		pthread_mutex_lock(&(internal->idle_mutex));
+		if (internal->deactivated) {
+			/* JACK doesn't run the process callback until activated */
+			internal->idle = 0;
+			internal->empty_cycles = 0;
+			status = jack_activate(internal->client);
+			if (status == 0) {
+				pthread_mutex_lock(&(internal->input_mutex));
+				internal->deactivated = 0;
+				pthread_mutex_unlock(&(internal->input_mutex));
+				adebug("%s: client reactivated\n", internal->client_name);
+				status = connect_ports(internal);
+			} else {
+				/* stay deactivated, the write fails instead of waiting for JACK */
+				internal->idle = 1;
 			}
 		}
+		internal->deactivation_requested = 0;
+		pthread_mutex_unlock(&(internal->idle_mutex));
 	}
+	return status;
 }
 
-static void array_uint32_to_float(const char *src, float *dest, size_t nvalues)
+/**
+ * Mark the beginning of a write and reactivate the client if needed
+ *
+ * The idle thread doesn't deactivate the client until end_play is called
+ * so that the frames written can't get stuck in the input buffers.
+ */
+static int begin_play(ao_jack_internal *internal)
+{
+	if (internal->idle_thread_running) {
+		pthread_mutex_lock(&(internal->idle_mutex));
+		internal->playing++;
+		pthread_mutex_unlock(&(internal->idle_mutex));
+	}
+	return resume_client(internal);
+}
+
+/**
+ * Mark the end of a write
+ */
+static void end_play(ao_jack_internal *internal)
+{
+	if (internal->idle_thread_running) {
+		pthread_mutex_lock(&(internal->idle_mutex));
+		internal->playing--;
+		pthread_mutex_unlock(&(internal->idle_mutex));
+	}
+}
+
+/**
+ * Fill the output ports with silence
+ */
+static void play_silence(ao_jack_internal *internal, jack_nframes_t nframes)
 {
-	const sint_32 *p;
 	size_t i;
-	for (i=0, p = (sint_32*)src; i < nvalues; i++, p++)
-		dest[i] = (float)(*p) / 2147483648.0f;
+	for (i = 0; i < internal->nports; i++) {
+		sample_t *out = (sample_t *) jack_port_get_buffer(internal->output_ports[i], nframes);
+		memset(out, 0, nframes * sizeof(sample_t));
+	}
+}
+
+/************************************************************
+ * Prebuffering
+ */
+
+/**
+ * Estimate the number of frames JACK consumes between two writes
+ *
+ * Called by ao_plugin_play while the playback is not started. The frames
+ * written since the first write are compared to the frames JACK would
+ * have consumed meanwhile. A producer slower than JACK gets no estimate
+ * and waits for the full prebuffer.
+ */
+static void measure_producer(ao_jack_internal *internal, size_t input_frames)
+{
+	jack_time_t now = jack_get_time();
+	if (__atomic_load_n(&(internal->started), __ATOMIC_ACQUIRE)) {
+		if (internal->fast_start_frames > 0)
+			__atomic_store_n(&(internal->fast_start_frames), 0, __ATOMIC_RELEASE);
+		internal->producer_start = 0;
+		return;
+	}
+	if (internal->producer_start == 0) {
+		internal->producer_start = now;
+		internal->producer_frames = 0;
+		internal->producer_writes = 0;
+	} else if (now > internal->producer_start) {
+		uint64_t consumed = (uint64_t)(now - internal->producer_start) * internal->output_rate / 1000000;
+		size_t needed = 0;
+		if (internal->producer_frames >= consumed)
+			needed = consumed / internal->producer_writes + 1;
+		__atomic_store_n(&(internal->fast_start_frames), needed, __ATOMIC_RELEASE);
+	}
+	internal->producer_frames += (uint64_t)input_frames * internal->output_rate / internal->input_rate;
+	internal->producer_writes++;
+}
+
+/**
+ * Called by JACK to decide if enough frames are queued to start playing
+ *
+ * The playback also starts if the producer doesn't reach the prebuffer
+ * level within the prebuffer duration.
+ */
+static int prebuffer_ready(ao_jack_internal *internal, size_t queued, jack_nframes_t nframes)
+{
+	size_t threshold = internal->prebuffer_frames;
+	if (internal->fast_start) {
+		size_t needed = __atomic_load_n(&(internal->fast_start_frames), __ATOMIC_ACQUIRE);
+		if (needed > 0 && needed + nframes < threshold)
+			threshold = needed + nframes;
+	}
+	if (queued >= threshold || internal->prebuffer_waited >= internal->prebuffer_frames)
+		return 1;
+	internal->prebuffer_waited += nframes;
+	return 0;
 }
 
 /**
  * Called by jack to get samples
+ *
+ * After idle_cycles periods without frames, only silence is output and
+ * the producer is not signaled anymore until frames are available.
  */
 static int on_jack_hungry(jack_nframes_t nframes, void *arg)
 {
 	ao_jack_internal *internal = (ao_jack_internal*)arg;
 	pthread_mutex_t *mutex_p = &(internal->input_mutex);
 	pthread_cond_t *cond_p = &(internal->input_cond);
+	jack_ringbuffer_t **input_channels = internal->input_channels;
+	AOJACK_TRACE_TIMER(start, hungry_return);
+
+	/* ports are registered after the client is activated */
+	if (internal->nports == 0)
+		return 0;
+
+	AOJACK_TRACE2(hungry_entry, nframes, jack_ringbuffer_read_space(input_channels[0]) / sizeof(sample_t));
+	if (internal->idle) {
+		if (jack_ringbuffer_read_space(input_channels[0]) == 0) {
+			play_silence(internal, nframes);
+			if (internal->idle_thread_running)
+				request_deactivation(internal);
+			AOJACK_TRACE2(hungry_return, nframes, AOJACK_TRACE_ELAPSED(start));
+			return 0;
+		}
+		internal->idle = 0;
+	}
+	if (!internal->started) {
+		size_t queued = jack_ringbuffer_read_space(input_channels[0]) / sizeof(sample_t);
+		if (queued == 0 || !prebuffer_ready(internal, queued, nframes)) {
+			play_silence(internal, nframes);
+			AOJACK_TRACE2(hungry_return, nframes, AOJACK_TRACE_ELAPSED(start));
+			return 0;
+		}
+		__atomic_store_n(&(internal->started), 1, __ATOMIC_RELEASE);
+	}
 	if (nframes > 0) {
-		jack_ringbuffer_t **input_channels = internal->input_channels;
 		size_t i;
+		size_t played_frames = jack_ringbuffer_read_space(input_channels[0]) / sizeof(sample_t);
+		if (played_frames > nframes)
+			played_frames = nframes;
+		update_clock(internal, nframes, played_frames);
+		if (played_frames < nframes) {
+			AOJACK_TRACE2(underrun, nframes - played_frames, nframes);
+			/* the next frames written must fade in */
+			__atomic_store_n(&(internal->declick), 1, __ATOMIC_RELEASE);
+			if (internal->idle_thread_running && __atomic_load_n(&(internal->coalesce_fill), __ATOMIC_RELAXED) > 0)
+				request_flush(internal);
+		}
+		if (played_frames == 0 && internal->idle_cycles > 0) {
+			if (++internal->empty_cycles >= internal->idle_cycles) {
+				internal->idle = 1;
+				/* prebuffer again when resuming */
+				if (internal->prebuffer_frames > 0) {
+					internal->prebuffer_waited = 0;
+					__atomic_store_n(&(internal->started), 0, __ATOMIC_RELEASE);
+				}
+			}
+		} else
+			internal->empty_cycles = 0;
 		for (i = 0; i < internal->nports; i++) {
 			sample_t *out = (sample_t *) jack_port_get_buffer(internal->output_ports[i], nframes);
 			size_t available_bytes = jack_ringbuffer_read_space(input_channels[i]);
@@ -297,11 +921,8 @@ static int on_jack_hungry(jack_nframes_t nframes, void *arg)
 			read_frames = read_bytes / sizeof(sample_t);
 
 			/* Filling the remaining frames with silence */
-			if (read_frames < nframes) {
-				size_t j;
-				for (j = read_frames; j < nframes; j++)
-					out[j] = 0.0f;
-			}
+			if (read_frames < nframes)
+				memset(out + read_frames, 0, (nframes - read_frames) * sizeof(sample_t));
 		}
 	}
 	if (pthread_mutex_lock(mutex_p) == 0) {
@@ -309,24 +930,155 @@ static int on_jack_hungry(jack_nframes_t nframes, void *arg)
 		pthread_cond_signal(cond_p);
 		pthread_mutex_unlock(mutex_p);
 	}
+	AOJACK_TRACE2(hungry_return, nframes, AOJACK_TRACE_ELAPSED(start));
 	return 0;
 }
 
 /**
  * Write each channel one after the other in the destination buffer
+ *
+ * Frames are processed by tiles so that the strided reads of a channel
+ * hit the cache.
  */
-static void deinterleave_frames(int nchannels, size_t nframes, float *source, float *destination)
+static void deinterleave_frames(size_t nchannels, size_t nframes, const float *source, float *destination)
 {
-	size_t c, f;
-	size_t i = 0;
-	for (f = 0; f < nframes; f++) {
+	size_t tile_frames = DEINTERLEAVE_TILE_SIZE / nchannels;
+	size_t first, c, f;
+	if (tile_frames == 0)
+		tile_frames = 1;
+	for (first = 0; first < nframes; first += tile_frames) {
+		size_t last = first + tile_frames;
+		if (last > nframes)
+			last = nframes;
 		for (c = 0; c < nchannels; c++) {
-			destination[c * nframes + f] = source[i];
-			i++;
+			const float *in = source + first * nchannels + c;
+			float *out = destination + c * nframes;
+			for (f = first; f < last; f++, in += nchannels)
+				out[f] = *in;
+		}
+	}
+}
+
+/*
+ * Variants for common layouts, unrolled over the channels of a tile
+ */
+
+static void deinterleave_frames_2(size_t nchannels, size_t nframes, const float *source, float *destination)
+{
+	float *out0 = destination;
+	float *out1 = out0 + nframes;
+	size_t first, f;
+	(void)nchannels;
+	for (first = 0; first < nframes; first += DEINTERLEAVE_TILE_SIZE / 2) {
+		const float *in = source + first * 2;
+		size_t last = first + DEINTERLEAVE_TILE_SIZE / 2;
+		if (last > nframes)
+			last = nframes;
+		for (f = first; f < last; f++, in += 2) {
+			out0[f] = in[0];
+			out1[f] = in[1];
+		}
+	}
+}
+
+static void deinterleave_frames_6(size_t nchannels, size_t nframes, const float *source, float *destination)
+{
+	float *out0 = destination;
+	float *out1 = out0 + nframes;
+	float *out2 = out1 + nframes;
+	float *out3 = out2 + nframes;
+	float *out4 = out3 + nframes;
+	float *out5 = out4 + nframes;
+	size_t first, f;
+	(void)nchannels;
+	for (first = 0; first < nframes; first += DEINTERLEAVE_TILE_SIZE / 6) {
+		const float *in = source + first * 6;
+		size_t last = first + DEINTERLEAVE_TILE_SIZE / 6;
+		if (last > nframes)
+			last = nframes;
+		for (f = first; f < last; f++, in += 6) {
+			out0[f] = in[0];
+			out1[f] = in[1];
+			out2[f] = in[2];
+			out3[f] = in[3];
+			out4[f] = in[4];
+			out5[f] = in[5];
+		}
+	}
+}
+
+static void deinterleave_frames_8(size_t nchannels, size_t nframes, const float *source, float *destination)
+{
+	float *out0 = destination;
+	float *out1 = out0 + nframes;
+	float *out2 = out1 + nframes;
+	float *out3 = out2 + nframes;
+	float *out4 = out3 + nframes;
+	float *out5 = out4 + nframes;
+	float *out6 = out5 + nframes;
+	float *out7 = out6 + nframes;
+	size_t first, f;
+	(void)nchannels;
+	for (first = 0; first < nframes; first += DEINTERLEAVE_TILE_SIZE / 8) {
+		const float *in = source + first * 8;
+		size_t last = first + DEINTERLEAVE_TILE_SIZE / 8;
+		if (last > nframes)
+			last = nframes;
+		for (f = first; f < last; f++, in += 8) {
+			out0[f] = in[0];
+			out1[f] = in[1];
+			out2[f] = in[2];
+			out3[f] = in[3];
+			out4[f] = in[4];
+			out5[f] = in[5];
+			out6[f] = in[6];
+			out7[f] = in[7];
 		}
 	}
 }
 
+/**
+ * Select the deinterleave function for a number of channels
+ *
+ * Mono frames are written directly without being copied.
+ */
+static aojack_deinterleave_t select_deinterleave(size_t nchannels)
+{
+	switch (nchannels) {
+	case 2:
+		return deinterleave_frames_2;
+	case 6:
+		return deinterleave_frames_6;
+	case 8:
+		return deinterleave_frames_8;
+	default:
+		return deinterleave_frames;
+	}
+}
+
+/**
+ * Fade in the frames written after an underrun
+ *
+ * The input buffers are empty when JACK flags the underrun, so the ramp
+ * starts with the first frames written afterwards, whatever chunk they
+ * belong to.
+ */
+static void apply_declick(ao_jack_internal *internal, size_t nchannels, float *data, size_t channel_frames, size_t nframes)
+{
+	size_t done = internal->declick_frames - internal->declick_left;
+	float step = 1.0f / internal->declick_frames;
+	size_t c, f;
+
+	if (nframes > internal->declick_left)
+		nframes = internal->declick_left;
+	for (c = 0; c < nchannels; c++) {
+		float *out = data + c * channel_frames;
+		for (f = 0; f < nframes; f++)
+			out[f] *= (float)(done + f + 1) * step;
+	}
+	internal->declick_left -= nframes;
+}
+
 /**
  * Write each channel in its input buffer to be fetched by JACK
  */
@@ -339,7 +1091,10 @@ static int write_deinterleaved_frames(ao_jack_internal *internal, size_t nchanne
 
 	while (nbytes_by_channel > 0 && !jack_shutdown) {
 		size_t i;
-		size_t available = jack_ringbuffer_write_space(input_channels[0]);
+		size_t available;
+		if (internal->deactivated && resume_client(internal) != 0)
+			return -1;
+		available = jack_ringbuffer_write_space(input_channels[0]);
 		for (i = 1; i < nchannels; i++) {
 			size_t available2 = jack_ringbuffer_write_space(input_channels[i]);
 			if (available2 < available)
@@ -351,6 +1106,10 @@ static int write_deinterleaved_frames(ao_jack_internal *internal, size_t nchanne
 		if (available > 0) {
 			const char *start = (const char *)data + pos;
 			size_t written = 0;
+			if (internal->declick_frames > 0 && __atomic_exchange_n(&(internal->declick), 0, __ATOMIC_ACQ_REL))
+				internal->declick_left = internal->declick_frames;
+			if (internal->declick_left > 0)
+				apply_declick(internal, nchannels, (float *)start, nframes, available / sizeof(float));
 			for (i = 0; i < nchannels; i++) {
 				size_t written2 = jack_ringbuffer_write(input_channels[i], start, available);
 				if (i == 0)
@@ -365,10 +1124,14 @@ static int write_deinterleaved_frames(ao_jack_internal *internal, size_t nchanne
 		} else { /* buffer is full */
 			pthread_mutex_t *mutex_p = &(internal->input_mutex);
 			pthread_cond_t *cond_p = &(internal->input_cond);
+			AOJACK_TRACE_TIMER(wait_start, producer_wake);
+			AOJACK_TRACE1(producer_block, jack_ringbuffer_read_space(input_channels[0]) / sizeof(float));
 			if (pthread_mutex_lock(mutex_p) == 0) {
 				/* wait for consumer thread */
-				pthread_cond_wait(cond_p, mutex_p);
+				if (!internal->deactivated)
+					pthread_cond_wait(cond_p, mutex_p);
 				pthread_mutex_unlock(mutex_p);
+				AOJACK_TRACE1(producer_wake, AOJACK_TRACE_ELAPSED(wait_start));
 			} else {
 				return -1;
 			}
@@ -377,30 +1140,280 @@ static int write_deinterleaved_frames(ao_jack_internal *internal, size_t nchanne
 	return 0;
 }
 
+/**
+ * Wait until JACK has played the frames queued in the input buffers
+ */
+static void drain_input_channels(ao_jack_internal *internal)
+{
+	pthread_mutex_t *mutex_p = &(internal->input_mutex);
+	pthread_cond_t *cond_p = &(internal->input_cond);
+
+	while (internal->nports > 0 && !jack_shutdown && jack_ringbuffer_read_space(internal->input_channels[0]) > 0) {
+		if (internal->deactivated && resume_client(internal) != 0)
+			break;
+		if (pthread_mutex_lock(mutex_p) != 0)
+			break;
+		/* wait for consumer thread */
+		if (!internal->deactivated)
+			pthread_cond_wait(cond_p, mutex_p);
+		pthread_mutex_unlock(mutex_p);
+	}
+}
+
 /**
  * Callback for processing incoming frames
  *
- * Deinterleave frames, resample them if needed and send them to JACK
+ * Deinterleave frames if they are not planar and send them to JACK
  */
-static int on_frames_available(size_t nchannels, size_t nframes, float *interleaved_data, void *arg)
+static int on_frames_available(size_t nchannels, size_t input_frames, size_t nframes, float *interleaved_data, int planar, void *arg)
 {
 	int status = 0;
 	ao_jack_internal *internal = (ao_jack_internal*)arg;
 	float *data = interleaved_data;
-	float *deinterleaved_data = NULL;
 
-	if (nchannels > 1) {
-		data = deinterleaved_data = malloc(nchannels * nframes * sizeof(float));
-		deinterleave_frames(nchannels, nframes, interleaved_data, data);
+	if (nchannels > 1 && !planar) {
+		if (nframes > internal->deinterleave_frames) {
+			data = realloc(internal->deinterleave_buffer, nchannels * nframes * sizeof(float));
+			if (data == NULL)
+				return -1;
+			internal->deinterleave_buffer = data;
+			internal->deinterleave_frames = nframes;
+		}
+		data = internal->deinterleave_buffer;
+		internal->deinterleave(nchannels, nframes, interleaved_data, data);
 	}
 
+	record_clock_chunk(internal, input_frames, nframes);
 	status = write_deinterleaved_frames(internal, nchannels, nframes, data);
 
-	if (deinterleaved_data)
-		free(deinterleaved_data);
 	return status;
 }
 
+/**
+ * Convert raw frames, resample them and send them to JACK
+ *
+ * Each chunk is converted just before it is resampled so that a gain
+ * change requested meanwhile applies to the next chunk.
+ */
+static int resample_frames(ao_jack_internal *internal, const char *samples, size_t nframes)
+{
+	size_t nchannels = internal->nchannels;
+	size_t frame_size = nchannels * internal->bits / 8;
+	size_t convert_frames;
+	float *data;
+	int status = 0;
+
+	/* We must not write more bytes that the input buffer can contain. Otherwise it is
+	 * not possible to resample the frames while jack is consuming the previous chunk.
+	 * Each channel has its own input buffer, we estimate the number of frames it can
+	 * hold according to the convertion ratio. And we write half this size to always
+	 * be able to convert some frames while the rest is played. */
+	size_t max_input_frames = INPUT_BUFFER_FRAMES * internal->input_rate / internal->output_rate / 2;
+	size_t i;
+
+	convert_frames = (nframes > max_input_frames ? max_input_frames : nframes);
+	if (convert_frames > internal->convert_frames) {
+		data = (float*)realloc(internal->convert_buffer, nchannels * convert_frames * sizeof(float));
+		if (data == NULL)
+			return -1;
+		internal->convert_buffer = data;
+		internal->convert_frames = convert_frames;
+	}
+	data = internal->convert_buffer;
+
+	for (i = 0; i < nframes && status == 0; i += max_input_frames) {
+		size_t partial_nframes = max_input_frames;
+		if (i + max_input_frames > nframes)
+			partial_nframes = nframes - i;
+		convert_samples(internal, samples + i * frame_size, data, partial_nframes);
+		status = aojack_resample_frames(internal->resampler, partial_nframes, data);
+	}
+	return status;
+}
+
+/**
+ * Check if JACK is about to run out of frames while some are coalesced
+ */
+static int coalesce_running_low(ao_jack_internal *internal)
+{
+	size_t queued = jack_ringbuffer_read_space(internal->input_channels[0]) / sizeof(float);
+	return (__atomic_load_n(&(internal->started), __ATOMIC_ACQUIRE) && queued < internal->coalesce_low);
+}
+
+/**
+ * Convert raw samples to float, resample them and send them to JACK
+ *
+ * With coalescing, raw frames are gathered in the coalesce buffer and
+ * converted once it is full or when JACK is about to run out of frames,
+ * so that the gain applies when they are played. If the producer stops
+ * writing, the idle thread flushes them when JACK runs out of frames.
+ * Writes of at least coalesce_frames are processed directly when the
+ * buffer is empty.
+ */
+static int process_samples(ao_jack_internal *internal, const char *samples, size_t num_bytes)
+{
+	size_t nchannels = internal->nchannels;
+	size_t frame_size = nchannels * internal->bits / 8;
+	size_t nframes = num_bytes / frame_size;
+	int status = 0;
+
+	while (status == 0 && nframes > 0 && internal->coalesce_frames > 0) {
+		size_t n = internal->coalesce_frames - internal->coalesce_fill;
+		if (internal->coalesce_fill == 0 && nframes >= internal->coalesce_frames)
+			break;
+		if (n > nframes)
+			n = nframes;
+		memcpy(internal->coalesce_buffer + internal->coalesce_fill * frame_size, samples, n * frame_size);
+		internal->coalesce_fill += n;
+		samples += n * frame_size;
+		nframes -= n;
+		if (internal->coalesce_fill == internal->coalesce_frames || coalesce_running_low(internal))
+			status = flush_samples(internal);
+	}
+
+	if (status == 0 && nframes > 0)
+		status = resample_frames(internal, samples, nframes);
+	return status;
+}
+
+/**
+ * Process the frames gathered in the coalesce buffer
+ */
+static int flush_samples(ao_jack_internal *internal)
+{
+	int status = 0;
+	if (internal->coalesce_fill > 0) {
+		status = resample_frames(internal, internal->coalesce_buffer, internal->coalesce_fill);
+		internal->coalesce_fill = 0;
+	}
+	return status;
+}
+
+/************************************************************
+ * Asynchronous conversion
+ */
+
+/**
+ * Worker thread converting the samples queued in the staging buffer
+ *
+ * Only whole frames are processed. The staging buffer is drained before
+ * the thread exits.
+ */
+static void *async_worker(void *arg)
+{
+	ao_jack_internal *internal = (ao_jack_internal*)arg;
+	jack_ringbuffer_t *staging = internal->staging;
+	pthread_mutex_t *mutex_p = &(internal->staging_mutex);
+	size_t frame_size = internal->nchannels * internal->bits / 8;
+	size_t max_chunk_size = STAGING_CHUNK_SIZE / frame_size * frame_size;
+	int status = 0;
+
+	for (;;) {
+		size_t available = jack_ringbuffer_read_space(staging);
+		if (available >= frame_size) {
+			size_t chunk_size = (available > max_chunk_size ? max_chunk_size : available / frame_size * frame_size);
+			jack_ringbuffer_read(staging, internal->worker_buffer, chunk_size);
+			if (pthread_mutex_lock(mutex_p) == 0) {
+				/* signal waiting producer thread */
+				pthread_cond_signal(&(internal->staging_space_cond));
+				pthread_mutex_unlock(mutex_p);
+			}
+			/* after an error, samples are discarded to not block the producer */
+			if (status == 0 && !jack_shutdown) {
+				status = begin_play(internal);
+				if (status == 0)
+					status = process_samples(internal, internal->worker_buffer, chunk_size);
+				end_play(internal);
+				if (status != 0) {
+					pthread_mutex_lock(mutex_p);
+					internal->worker_status = status;
+					pthread_cond_signal(&(internal->staging_space_cond));
+					pthread_mutex_unlock(mutex_p);
+				}
+			}
+		} else if (pthread_mutex_lock(mutex_p) == 0) {
+			int stop = internal->worker_stop;
+			if (!stop && jack_ringbuffer_read_space(staging) < frame_size)
+				pthread_cond_wait(&(internal->staging_data_cond), mutex_p);
+			pthread_mutex_unlock(mutex_p);
+			if (stop)
+				break;
+		} else
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * Allocate the staging buffer and start the worker thread
+ */
+static int start_async_worker(ao_jack_internal *internal)
+{
+	internal->worker_stop = 0;
+	internal->worker_status = 0;
+	internal->staging = jack_ringbuffer_create(STAGING_BUFFER_SIZE);
+	internal->worker_buffer = malloc(STAGING_CHUNK_SIZE);
+	if (internal->staging == NULL || internal->worker_buffer == NULL)
+		return 0;
+	if (pthread_create(&(internal->worker), NULL, async_worker, internal) != 0)
+		return 0;
+	internal->worker_running = 1;
+	return 1;
+}
+
+/**
+ * Stop the worker thread once the staging buffer is drained
+ */
+static void stop_async_worker(ao_jack_internal *internal)
+{
+	if (internal->worker_running) {
+		pthread_mutex_lock(&(internal->staging_mutex));
+		internal->worker_stop = 1;
+		pthread_cond_signal(&(internal->staging_data_cond));
+		pthread_mutex_unlock(&(internal->staging_mutex));
+		pthread_join(internal->worker, NULL);
+		internal->worker_running = 0;
+	}
+	if (internal->staging) {
+		jack_ringbuffer_free(internal->staging);
+		internal->staging = NULL;
+	}
+	free(internal->worker_buffer);
+	internal->worker_buffer = NULL;
+}
+
+/**
+ * Queue raw samples for the worker thread
+ *
+ * Block only if the staging buffer is full.
+ */
+static int enqueue_samples(ao_jack_internal *internal, const char *samples, size_t num_bytes)
+{
+	jack_ringbuffer_t *staging = internal->staging;
+	pthread_mutex_t *mutex_p = &(internal->staging_mutex);
+
+	while (num_bytes > 0 && !jack_shutdown && internal->worker_status == 0) {
+		size_t available = jack_ringbuffer_write_space(staging);
+		if (available > 0) {
+			size_t written = jack_ringbuffer_write(staging, samples, (available > num_bytes ? num_bytes : available));
+			samples += written;
+			num_bytes -= written;
+			if (pthread_mutex_lock(mutex_p) == 0) {
+				/* signal waiting worker thread */
+				pthread_cond_signal(&(internal->staging_data_cond));
+				pthread_mutex_unlock(mutex_p);
+			}
+		} else if (pthread_mutex_lock(mutex_p) == 0) {
+			/* wait for worker thread */
+			if (jack_ringbuffer_write_space(staging) == 0 && internal->worker_status == 0)
+				pthread_cond_wait(&(internal->staging_space_cond), mutex_p);
+			pthread_mutex_unlock(mutex_p);
+		} else
+			return -1;
+	}
+	return (num_bytes == 0 ? 0 : -1);
+}
+
 /************************************************************
  * Plugin interface
  */
@@ -445,8 +1458,16 @@ int ao_plugin_device_init(ao_device *device)
 	internal->client = NULL;
 	internal->client_name = strdup(CLIENT_NAME);
 	internal->quality = 5;
+	internal->resample_threads = 1;
+	internal->gain_target = 1.0f;
+	internal->gain_ramp_ms = 10;
 	pthread_mutex_init(&(internal->input_mutex), NULL);
 	pthread_cond_init(&(internal->input_cond), NULL);
+	pthread_mutex_init(&(internal->staging_mutex), NULL);
+	pthread_cond_init(&(internal->staging_data_cond), NULL);
+	pthread_cond_init(&(internal->staging_space_cond), NULL);
+	pthread_mutex_init(&(internal->idle_mutex), NULL);
+	pthread_cond_init(&(internal->idle_cond), NULL);
 
 	device->internal = internal;
         device->output_matrix = strdup("L,R,BL,BR,C,LFE,SL,SR");
@@ -464,20 +1485,41 @@ int ao_plugin_set_option(ao_device *device, const char *key, const char *value)
 {
 	ao_jack_internal *internal = (ao_jack_internal *) device->internal;
 
-	if (strcmp(key, "client_name") == 0) {
+	if (strcmp(key, "async") == 0) {
+		internal->async = parse_boolean_option(value);
+	} else if (strcmp(key, "client_name") == 0) {
 		free(internal->client_name);
 		internal->client_name = strdup(value);
+	} else if (strcmp(key, "coalesce") == 0) {
+		internal->coalesce = strtoul(value, NULL, 10);
 	} else if (strcmp(key, "dev") == 0) {
 		/* ignore */
+	} else if (strcmp(key, "fast_start") == 0) {
+		internal->fast_start = parse_boolean_option(value);
+	} else if (strcmp(key, "gain") == 0) {
+		internal->gain_target = strtod(value, NULL);
+	} else if (strcmp(key, "gain_ramp") == 0) {
+		internal->gain_ramp_ms = strtoul(value, NULL, 10);
 	} else if (strcmp(key, "id") == 0) {
 		/* ignore */
+	} else if (strcmp(key, "idle_cycles") == 0) {
+		internal->idle_cycles = strtoul(value, NULL, 10);
+	} else if (strcmp(key, "idle_deactivate") == 0) {
+		internal->idle_deactivate = parse_boolean_option(value);
 	} else if (strcmp(key, "ports") == 0) {
 		char *writable_value = strdup(value);
 		free_string_array(internal->port_names);
 		internal->port_names = parse_comma_separated_option(writable_value);
 		free(writable_value);
+	} else if (strcmp(key, "prebuffer") == 0) {
+		/* number of frames or duration with suffix ms */
+		char *unit = NULL;
+		internal->prebuffer = strtoul(value, &unit, 10);
+		internal->prebuffer_in_ms = (strcmp(unit, "ms") == 0);
 	} else if (strcmp(key, "quality") == 0) {
 		internal->quality = strtoul(value, NULL, 10);
+	} else if (strcmp(key, "resample_threads") == 0) {
+		internal->resample_threads = strtoul(value, NULL, 10);
 	} else
 		return 0;
 
@@ -511,25 +1553,77 @@ int ao_plugin_open(ao_device *device, ao_sample_format *format)
 	internal->input_rate = format->rate;
 	internal->output_rate = jack_get_sample_rate(client);
 	internal->bits = format->bits;
-	internal->resampler = aojack_new_resampler(device->output_channels, internal->input_rate, internal->output_rate, internal->quality, on_frames_available, internal);
+	internal->nchannels = device->output_channels;
+	internal->deinterleave = select_deinterleave(internal->nchannels);
+	internal->gain_ramp_frames = internal->gain_ramp_ms * internal->input_rate / 1000;
+	internal->gain_ramp_left = 0;
+	internal->gain = internal->gain_ramp_target = internal->gain_target;
+	internal->declick = 0;
+	internal->declick_frames = internal->gain_ramp_ms * internal->output_rate / 1000;
+	internal->declick_left = 0;
+	internal->idle = 0;
+	internal->empty_cycles = 0;
+	internal->deactivation_requested = 0;
+	internal->flush_requested = 0;
+	internal->deactivated = 0;
+	internal->playing = 0;
+	internal->prebuffer_frames = internal->prebuffer;
+	if (internal->prebuffer_in_ms)
+		internal->prebuffer_frames = internal->prebuffer * internal->output_rate / 1000;
+	if (internal->fast_start && internal->prebuffer_frames == 0)
+		internal->prebuffer_frames = INPUT_BUFFER_FRAMES;
+	else if (internal->prebuffer_frames > INPUT_BUFFER_FRAMES)
+		internal->prebuffer_frames = INPUT_BUFFER_FRAMES;
+	internal->prebuffer_waited = 0;
+	internal->started = (internal->prebuffer_frames == 0);
+	internal->fast_start_frames = 0;
+	internal->producer_start = 0;
+	internal->input_frames_written = 0;
+	internal->output_frames_written = 0;
+	internal->output_frames_played = 0;
+	internal->has_clock_chunk = 0;
+	internal->clock.valid = 0;
+	internal->clock_chunks = jack_ringbuffer_create(CLOCK_CHUNKS * sizeof(aojack_clock_chunk_t));
+	if (internal->clock_chunks == NULL) {
+		close_internal(internal);
+		aerror("%s: cannot allocate the playback clock\n", internal->client_name);
+		return 0;
+	}
+	internal->resampler = aojack_new_resampler(device->output_channels, internal->input_rate, internal->output_rate, internal->quality, internal->resample_threads, on_frames_available, internal);
 	if (internal->resampler == NULL) {
-		internal->client = NULL;
-		jack_client_close(client);
+		close_internal(internal);
 		aerror("%s: cannot create the sample rate converter\n", internal->client_name);
 		return 0;
 	}
 	adebug("from %d to %d Hz (%lu)\n", internal->input_rate, internal->output_rate, internal->bits);
 
+	/* the coalesce quantum is a multiple of the JACK period */
+	internal->coalesce_frames = 0;
+	internal->coalesce_fill = 0;
+	if (internal->coalesce > 0) {
+		size_t period = (size_t)jack_get_buffer_size(client) * internal->input_rate / internal->output_rate;
+		if (period == 0)
+			period = 1;
+		internal->coalesce_frames = (internal->coalesce + period - 1) / period * period;
+		internal->coalesce_low = jack_get_buffer_size(client);
+		internal->coalesce_buffer = malloc(internal->coalesce_frames * internal->nchannels * internal->bits / 8);
+		if (internal->coalesce_buffer == NULL) {
+			close_internal(internal);
+			aerror("%s: cannot allocate the coalesce buffer\n", internal->client_name);
+			return 0;
+		}
+		adebug("coalescing writes by %lu frames\n", internal->coalesce_frames);
+	}
+
 	jack_shutdown = 0;
-	jack_on_shutdown(client, on_jack_shutdown, NULL);
+	jack_on_shutdown(client, on_jack_shutdown, internal);
 
 	/* activate the client */
 	jack_set_process_callback(client, on_jack_hungry, internal);
 	jack_set_sample_rate_callback(client, on_sample_rate_update, internal);
 	status = jack_activate(client);
 	if (status != 0) {
-		internal->client = NULL;
-		jack_client_close(client);
+		close_internal(internal);
 		aerror("%s: cannot activate client\n", internal->client_name);
 		return 0;
 	}
@@ -559,22 +1653,30 @@ int ao_plugin_open(ao_device *device, ao_sample_format *format)
 			internal->input_channels[i] = jack_ringbuffer_create(INPUT_BUFFER_SIZE);
 		}
 
-		for (i = 0; status == 0 && i < nreqports; i++) {
-			const char *port_name = jack_port_name(internal->output_ports[i]);
-			adebug("connecting %s to %s\n", port_name, port_names[i]);
-			status = jack_connect(client, port_name, port_names[i]);
-			if (status == EEXIST) {
-				aerror("%s: port %s is already connected\n", internal->client_name, port_name);
-			} else if (status != 0) {
-				aerror("%s: can't connect port %s (code: %d)\n", internal->client_name, port_name, status);
-			}
-		}
 		internal->nports = nreqports;
+
+		/* destinations are kept to reconnect the ports after a deactivation */
+		internal->destination_ports = copy_string_array(port_names);
+		if (internal->destination_ports == NULL)
+			status = -1;
+		else
+			status = connect_ports(internal);
 	}
 
 	if (physical_port_names)
 		jack_free(physical_port_names);
 
+	if (status == 0 && internal->async && !start_async_worker(internal)) {
+		aerror("%s: cannot start the conversion thread\n", internal->client_name);
+		status = -1;
+	}
+
+	if (status == 0 && ((internal->idle_deactivate && internal->idle_cycles > 0) || internal->coalesce_frames > 0)
+	    && !start_idle_thread(internal)) {
+		aerror("%s: cannot start the idle thread\n", internal->client_name);
+		status = -1;
+	}
+
 	if (status != 0) {
 		close_internal(internal);
 		return 0;
@@ -591,51 +1693,93 @@ int ao_plugin_play(ao_device *device, const char *output_samples, uint_32 num_by
 {
 	ao_jack_internal *internal = (ao_jack_internal*)device->internal;
 	size_t nchannels = device->output_channels;
-	size_t nvalues = (num_bytes * 8) / internal->bits;
-	size_t nframes = nvalues / nchannels;
 	int status = 0;
-	float *data = NULL;
-	size_t data_size = nchannels * nframes * sizeof(float);
+	AOJACK_TRACE_TIMER(start, play_return);
 
+	AOJACK_TRACE1(play_entry, num_bytes);
 	if (jack_shutdown) {
 		aerror("%s: jack is stopped\n", internal->client_name);
-		return 0;
+		status = -1;
 	} else if (nchannels > internal->nports) {
 		aerror("%s: %lu: too many channels, maximum is %lu\n", internal->client_name, nchannels, internal->nports);
-		return 0 ;
+		status = -1;
 	} else {
-		/* We must not write more bytes that the input buffer can contain. Otherwise it is
-		 * not possible to resample the frames while jack is consuming the previous chunk.
-		 * We estimate the number of frames the input buffer can hold according to the
-		 * convertion ratio. And we write half this size to always be able to convert
-		 * some frames while the rest is played. */
-		size_t max_input_frames = (INPUT_BUFFER_SIZE / (nchannels * sizeof(float)) * internal->input_rate) / internal->output_rate / 2;
-		size_t i;
-
-		data = (float*)malloc(data_size);
-		if (internal->bits == 8) {
-			array_uint8_to_float(output_samples, data, nvalues);
-		} else if (internal->bits == 16) {
-			array_uint16_to_float(output_samples, data, nvalues);
-		} else if (internal->bits == 24) {
-			array_uint24_to_float(output_samples, data, nvalues);
-		} else if (internal->bits == 32) {
-			array_uint32_to_float(output_samples, data, nvalues);
-		}
-
-		for (i = 0; i < nframes && status == 0; i += max_input_frames) {
-			size_t partial_nframes = max_input_frames;
-			float *partial_data = data + (i * nchannels);
-			if (i + max_input_frames > nframes)
-				partial_nframes = nframes - i;
-			status = aojack_resample_frames(internal->resampler, partial_nframes, partial_data);
+		if (internal->fast_start)
+			measure_producer(internal, num_bytes / (nchannels * internal->bits / 8));
+		if (begin_play(internal) != 0) {
+			aerror("%s: cannot reactivate client\n", internal->client_name);
+			status = -1;
+		} else if (internal->async) {
+			status = enqueue_samples(internal, output_samples, num_bytes);
+		} else {
+			status = process_samples(internal, output_samples, num_bytes);
 		}
-		free(data);
+		end_play(internal);
 	}
+	AOJACK_TRACE2(play_return, num_bytes, AOJACK_TRACE_ELAPSED(start));
 	return (status == 0 ? 1 : 0);
 }
 
 
+/**
+ * Get the input frame being played and the time it is audible in microseconds
+ *
+ * The frame is interpolated to the current JACK frame time, unless the
+ * producer stopped and the last frames queued were already played.
+ *
+ * This function is not part of the libao plugin interface. Applications
+ * get it with dlsym on the plugin. It doesn't block and can be called from
+ * any thread while the device is open. Return 0 if nothing was played yet.
+ */
+int ao_plugin_jack_get_position(ao_device *device, uint64_t *frame, uint64_t *usecs)
+{
+	ao_jack_internal *internal = (ao_jack_internal*)device->internal;
+	jack_client_t *client = internal->client;
+	aojack_clock_t clock;
+	unsigned long sequence;
+	int32_t elapsed;
+	double position;
+
+	if (client == NULL)
+		return 0;
+
+	do {
+		sequence = __atomic_load_n(&(internal->clock_sequence), __ATOMIC_ACQUIRE);
+		clock = internal->clock;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((sequence & 1) || sequence != __atomic_load_n(&(internal->clock_sequence), __ATOMIC_RELAXED));
+
+	if (!clock.valid)
+		return 0;
+
+	/* the frame time wraps around, differences are signed. The snapshot is
+	 * audible after the latency, so the current frame is usually before it. */
+	elapsed = (int32_t)(jack_frame_time(client) - clock.frame_time);
+	if (elapsed > (int32_t)clock.nframes)
+		elapsed = (int32_t)clock.nframes;
+
+	position = (double)clock.input_frame + (double)elapsed * clock.ratio;
+	*frame = (position > 0 ? (uint64_t)position : 0);
+	*usecs = jack_frames_to_time(client, clock.frame_time + elapsed);
+	return 1;
+}
+
+
+/**
+ * Change the gain applied to the samples
+ *
+ * This function is not part of the libao plugin interface. Applications
+ * get it with dlsym on the plugin. It doesn't block and can be called from
+ * any thread. The new gain is reached with a ramp of gain_ramp ms.
+ */
+int ao_plugin_jack_set_gain(ao_device *device, float gain)
+{
+	ao_jack_internal *internal = (ao_jack_internal*)device->internal;
+	__atomic_store(&(internal->gain_target), &gain, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
 /**
  * Close the audio device
  */
@@ -668,6 +1812,11 @@ void ao_plugin_device_clear(ao_device *device)
 			free_string_array(internal->port_names);
 			pthread_mutex_destroy(&(internal->input_mutex));
 			pthread_cond_destroy(&(internal->input_cond));
+			pthread_mutex_destroy(&(internal->staging_mutex));
+			pthread_cond_destroy(&(internal->staging_data_cond));
+			pthread_cond_destroy(&(internal->staging_space_cond));
+			pthread_mutex_destroy(&(internal->idle_mutex));
+			pthread_cond_destroy(&(internal->idle_cond));
 			free(internal);
 			device->internal = NULL;
 		} else
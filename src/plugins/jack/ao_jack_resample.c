@@ -24,9 +24,29 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <samplerate.h>
 
 #include "ao_jack_resample.h"
+#include "ao_jack_trace.h"
+
+/**
+ * Subset of consecutive channels resampled by its own converter
+ */
+typedef struct _aojack_resampler_group_t {
+	struct _aojack_resampler_t *resampler;
+	SRC_STATE *state;
+	size_t first_channel;
+	size_t channels;
+	/* group channels interleaved */
+	float *input;
+	float *output;
+	long input_frames_used;
+	long output_frames_gen;
+	int status;
+	pthread_t thread;
+} aojack_resampler_group_t;
 
 struct _aojack_resampler_t {
 	SRC_STATE *state;
@@ -38,6 +58,22 @@ struct _aojack_resampler_t {
 	int quality;
 	aojack_write_frames_t callback;
 	void *arg;
+
+	/* output buffer kept between calls */
+	float *output;
+	size_t output_frames;
+
+	/* parallel resampling, group 0 is processed by the calling thread */
+	size_t ngroups;
+	aojack_resampler_group_t *groups;
+	size_t group_frames;
+	SRC_DATA job;
+	unsigned long generation;
+	size_t pending;
+	int stop;
+	pthread_mutex_t pool_mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
 };
 
 static int quality_levels[] = {
@@ -50,9 +86,229 @@ static int quality_levels[] = {
 
 static size_t NUMBER_OF_QUALITY_LEVELS = sizeof(quality_levels) / sizeof(int);
 
-aojack_resampler_t *aojack_new_resampler(size_t nchannels, int src_rate, int dest_rate, unsigned long quality, aojack_write_frames_t callback, void *arg)
+/**
+ * Resample the channels of a group for the current job
+ *
+ * The channels are gathered from the interleaved input. The result is
+ * written channel after channel in the output so that the groups don't
+ * share cache lines.
+ */
+static void process_group(aojack_resampler_t *resampler, aojack_resampler_group_t *group)
+{
+	size_t nchannels = resampler->channels;
+	size_t gchannels = group->channels;
+	const float *in = resampler->job.data_in + group->first_channel;
+	float *out;
+	const float *p;
+	float *q;
+	long f;
+	size_t c;
+	SRC_DATA data;
+
+	for (f = 0, q = group->input; f < resampler->job.input_frames; f++, in += nchannels)
+		for (c = 0; c < gchannels; c++)
+			*q++ = in[c];
+
+	data.data_in = group->input;
+	data.data_out = group->output;
+	data.input_frames = resampler->job.input_frames;
+	data.output_frames = resampler->job.output_frames;
+	data.src_ratio = resampler->job.src_ratio;
+	data.end_of_input = 0;
+	group->status = src_process(group->state, &data);
+	group->input_frames_used = data.input_frames_used;
+	group->output_frames_gen = data.output_frames_gen;
+
+	if (group->status == 0) {
+		out = resampler->job.data_out + group->first_channel * data.output_frames_gen;
+		for (c = 0; c < gchannels; c++, out += data.output_frames_gen)
+			for (f = 0, p = group->output + c; f < data.output_frames_gen; f++, p += gchannels)
+				out[f] = *p;
+	}
+}
+
+/**
+ * Thread processing one group each time a new job is posted
+ */
+static void *group_worker(void *arg)
+{
+	aojack_resampler_group_t *group = (aojack_resampler_group_t*)arg;
+	aojack_resampler_t *resampler = group->resampler;
+	unsigned long generation = 0;
+
+	pthread_mutex_lock(&(resampler->pool_mutex));
+	for (;;) {
+		while (resampler->generation == generation && !resampler->stop)
+			pthread_cond_wait(&(resampler->work_cond), &(resampler->pool_mutex));
+		if (resampler->stop)
+			break;
+		generation = resampler->generation;
+		pthread_mutex_unlock(&(resampler->pool_mutex));
+
+		process_group(resampler, group);
+
+		pthread_mutex_lock(&(resampler->pool_mutex));
+		if (--resampler->pending == 0)
+			pthread_cond_signal(&(resampler->done_cond));
+	}
+	pthread_mutex_unlock(&(resampler->pool_mutex));
+	return NULL;
+}
+
+/**
+ * Realign the groups if their converters produced different numbers of frames
+ *
+ * All the converters are identical so it should not happen. Otherwise the
+ * extra frames are dropped and the converters restart from the same input
+ * frame.
+ */
+static void align_groups(aojack_resampler_t *resampler)
 {
-	aojack_resampler_t *resampler = (aojack_resampler_t*)malloc(sizeof(aojack_resampler_t));
+	aojack_resampler_group_t *groups = resampler->groups;
+	long input_frames_used = groups[0].input_frames_used;
+	long output_frames_gen = groups[0].output_frames_gen;
+	size_t i, c;
+
+	for (i = 1; i < resampler->ngroups; i++) {
+		if (groups[i].input_frames_used < input_frames_used)
+			input_frames_used = groups[i].input_frames_used;
+		if (groups[i].output_frames_gen < output_frames_gen)
+			output_frames_gen = groups[i].output_frames_gen;
+	}
+	/* channels are moved toward the start of the output, in order */
+	for (i = 0; i < resampler->ngroups; i++) {
+		for (c = groups[i].first_channel; c < groups[i].first_channel + groups[i].channels; c++)
+			memmove(resampler->job.data_out + c * output_frames_gen,
+				resampler->job.data_out + c * groups[i].output_frames_gen,
+				output_frames_gen * sizeof(float));
+		src_reset(groups[i].state);
+	}
+	resampler->job.input_frames_used = input_frames_used;
+	resampler->job.output_frames_gen = output_frames_gen;
+}
+
+/**
+ * Resample the current job with all the groups in parallel
+ */
+static int process_groups(aojack_resampler_t *resampler)
+{
+	size_t i;
+	aojack_resampler_group_t *groups = resampler->groups;
+
+	if ((size_t)resampler->job.input_frames > resampler->group_frames ||
+	    (size_t)resampler->job.output_frames > resampler->group_frames) {
+		size_t nframes = resampler->job.input_frames;
+		if ((size_t)resampler->job.output_frames > nframes)
+			nframes = resampler->job.output_frames;
+		for (i = 0; i < resampler->ngroups; i++) {
+			float *input = realloc(groups[i].input, nframes * groups[i].channels * sizeof(float));
+			float *output = realloc(groups[i].output, nframes * groups[i].channels * sizeof(float));
+			if (input)
+				groups[i].input = input;
+			if (output)
+				groups[i].output = output;
+			if (input == NULL || output == NULL)
+				return -1;
+		}
+		resampler->group_frames = nframes;
+	}
+
+	pthread_mutex_lock(&(resampler->pool_mutex));
+	resampler->pending = resampler->ngroups - 1;
+	resampler->generation++;
+	pthread_cond_broadcast(&(resampler->work_cond));
+	pthread_mutex_unlock(&(resampler->pool_mutex));
+
+	process_group(resampler, &groups[0]);
+
+	pthread_mutex_lock(&(resampler->pool_mutex));
+	while (resampler->pending > 0)
+		pthread_cond_wait(&(resampler->done_cond), &(resampler->pool_mutex));
+	pthread_mutex_unlock(&(resampler->pool_mutex));
+
+	resampler->job.input_frames_used = groups[0].input_frames_used;
+	resampler->job.output_frames_gen = groups[0].output_frames_gen;
+	for (i = 0; i < resampler->ngroups; i++) {
+		if (groups[i].status != 0)
+			return groups[i].status;
+		if (groups[i].input_frames_used != groups[0].input_frames_used ||
+		    groups[i].output_frames_gen != groups[0].output_frames_gen) {
+			align_groups(resampler);
+			break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Split the channels in groups having their own converter and thread
+ */
+static int new_resampler_groups(aojack_resampler_t *resampler, size_t ngroups)
+{
+	size_t nchannels = resampler->channels;
+	size_t i;
+	int error = 0;
+
+	resampler->groups = calloc(ngroups, sizeof(aojack_resampler_group_t));
+	if (resampler->groups == NULL)
+		return 0;
+	pthread_mutex_init(&(resampler->pool_mutex), NULL);
+	pthread_cond_init(&(resampler->work_cond), NULL);
+	pthread_cond_init(&(resampler->done_cond), NULL);
+	resampler->ngroups = ngroups;
+
+	for (i = 0; i < ngroups; i++) {
+		aojack_resampler_group_t *group = &(resampler->groups[i]);
+		group->resampler = resampler;
+		group->first_channel = i * nchannels / ngroups;
+		group->channels = (i + 1) * nchannels / ngroups - group->first_channel;
+		group->state = src_new(resampler->quality, group->channels, &error);
+		if (group->state == NULL)
+			return 0;
+		if (i > 0 && pthread_create(&(group->thread), NULL, group_worker, group) != 0) {
+			src_delete(group->state);
+			group->state = NULL;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Stop the threads and release the groups
+ */
+static void delete_resampler_groups(aojack_resampler_t *resampler)
+{
+	size_t i;
+
+	if (resampler->groups == NULL)
+		return;
+
+	pthread_mutex_lock(&(resampler->pool_mutex));
+	resampler->stop = 1;
+	pthread_cond_broadcast(&(resampler->work_cond));
+	pthread_mutex_unlock(&(resampler->pool_mutex));
+
+	for (i = 0; i < resampler->ngroups; i++) {
+		aojack_resampler_group_t *group = &(resampler->groups[i]);
+		if (group->state) {
+			if (i > 0)
+				pthread_join(group->thread, NULL);
+			src_delete(group->state);
+		}
+		free(group->input);
+		free(group->output);
+	}
+	free(resampler->groups);
+	resampler->groups = NULL;
+	pthread_mutex_destroy(&(resampler->pool_mutex));
+	pthread_cond_destroy(&(resampler->work_cond));
+	pthread_cond_destroy(&(resampler->done_cond));
+}
+
+aojack_resampler_t *aojack_new_resampler(size_t nchannels, int src_rate, int dest_rate, unsigned long quality, size_t nthreads, aojack_write_frames_t callback, void *arg)
+{
+	aojack_resampler_t *resampler = (aojack_resampler_t*)calloc(1, sizeof(aojack_resampler_t));
 	if (resampler) {
 		int error = 0;
 		resampler->channels = nchannels;
@@ -65,7 +321,16 @@ aojack_resampler_t *aojack_new_resampler(size_t nchannels, int src_rate, int des
 		resampler->quality = quality_levels[quality];
 		resampler->callback = callback;
 		resampler->arg = arg;
-		if (!resampler->passthrough) {
+		if (nthreads > nchannels)
+			nthreads = nchannels;
+		if (resampler->passthrough) {
+			/* nothing to do */
+		} else if (nthreads > 1) {
+			if (!new_resampler_groups(resampler, nthreads)) {
+				aojack_delete_resampler(resampler);
+				return NULL;
+			}
+		} else {
 			resampler->state = src_new(resampler->quality, nchannels, &error);
 			if (resampler->state == NULL) {
 				free(resampler);
@@ -85,6 +350,8 @@ void aojack_change_resampler_rate(aojack_resampler_t *resampler, int dest_rate)
 void aojack_delete_resampler(aojack_resampler_t *resampler)
 {
 	if (resampler) {
+		delete_resampler_groups(resampler);
+		free(resampler->output);
 		if (resampler->state) {
 			src_delete(resampler->state);
 			resampler->state = NULL;
@@ -97,31 +364,48 @@ int aojack_resample_frames(aojack_resampler_t *resampler, size_t nframes, float
 {
 	int status = 0;
 	size_t nchannels = resampler->channels;
+	AOJACK_TRACE_TIMER(start, resample_return);
+
+	AOJACK_TRACE1(resample_entry, nframes);
 	if (resampler->passthrough) {
-		status = resampler->callback(nchannels, nframes, data, resampler->arg);
+		status = resampler->callback(nchannels, nframes, nframes, data, 0, resampler->arg);
 	} else {
 		SRC_DATA resampler_data;
 		long remaining_frames = nframes;
 
 		/* Estimating the size of the output frames with a margin of 20%. The convertion should
-		 * take place in 1 loop. If it isn't the case, the rest is processed in the next loop. */
-		resampler_data.output_frames = nframes * resampler->ratio * 1.2;
-		resampler_data.data_out = (float*)malloc(resampler_data.output_frames * nchannels * sizeof(float));
+		 * take place in 1 loop. If it isn't the case, the rest is processed in the next loop.
+		 * The buffer is only reallocated if it is too small. */
+		size_t output_frames = nframes * resampler->ratio * 1.2 + 1;
+		if (output_frames > resampler->output_frames) {
+			float *output = (float*)realloc(resampler->output, output_frames * nchannels * sizeof(float));
+			if (output == NULL)
+				return -1;
+			resampler->output = output;
+			resampler->output_frames = output_frames;
+		}
+		resampler_data.output_frames = resampler->output_frames;
+		resampler_data.data_out = resampler->output;
 		resampler_data.src_ratio = resampler->ratio;
 		resampler_data.end_of_input = 0;
 		while (status == 0 && remaining_frames > 0) {
 			resampler_data.input_frames = remaining_frames;
 			resampler_data.data_in = data;
-			status = src_process(resampler->state, &resampler_data);
+			if (resampler->groups) {
+				resampler->job = resampler_data;
+				status = process_groups(resampler);
+				resampler_data = resampler->job;
+			} else
+				status = src_process(resampler->state, &resampler_data);
 			if (status == 0) {
 				if (resampler->callback)
-					status = resampler->callback(nchannels, resampler_data.output_frames_gen, resampler_data.data_out, resampler->arg);
+					status = resampler->callback(nchannels, resampler_data.input_frames_used, resampler_data.output_frames_gen, resampler_data.data_out, resampler->groups != NULL, resampler->arg);
 				remaining_frames -= resampler_data.input_frames_used;
 				data += (resampler_data.input_frames_used * nchannels);
 			}
 		}
-		free(resampler_data.data_out);
 	}
+	AOJACK_TRACE2(resample_return, nframes, AOJACK_TRACE_ELAPSED(start));
 	return status;
 }
 
@@ -28,9 +28,11 @@
 struct _aojack_resampler_t;
 typedef struct _aojack_resampler_t aojack_resampler_t;
 
-typedef int (*aojack_write_frames_t)(size_t nchannels, size_t nframes, float *data, void *arg);
+/* Called with the nframes resampled from input_frames, the channels follow each other if planar is set */
+typedef int (*aojack_write_frames_t)(size_t nchannels, size_t input_frames, size_t nframes, float *data, int planar, void *arg);
 
-aojack_resampler_t *aojack_new_resampler(size_t nchannels, int src_rate, int dest_rate, unsigned long quality, aojack_write_frames_t callback, void *arg);
+/* With nthreads > 1, channels are split in groups resampled in parallel */
+aojack_resampler_t *aojack_new_resampler(size_t nchannels, int src_rate, int dest_rate, unsigned long quality, size_t nthreads, aojack_write_frames_t callback, void *arg);
 
 void aojack_delete_resampler(aojack_resampler_t *resampler);
 
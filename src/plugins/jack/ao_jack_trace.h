@@ -0,0 +1,101 @@
+/*
+ *  ao_jack_trace.h
+ *
+ *  Copyright (C) 2014  Laurent Pelecq
+ *
+ *  This file is part of libao, a cross-platform library.  See
+ *  README for a history of this source code.
+ *
+ *  libao is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  libao is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GNU Make; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __INCLUDE_AOJACK_TRACE_H__
+#define __INCLUDE_AOJACK_TRACE_H__
+
+/*
+ * Static probes of the provider "aojack" for perf, bpftrace or SystemTap.
+ *
+ * They are compiled only if AOJACK_TRACEPOINTS is defined (configure
+ * option --enable-jack-tracepoints). Otherwise the macros expand to
+ * nothing. Durations are in nanoseconds.
+ *
+ * Each probe has a semaphore incremented by the tracer when it is
+ * attached. The arguments are evaluated and the timers are read only
+ * while the probe is enabled.
+ */
+
+#include <stdint.h>
+
+#ifdef AOJACK_TRACEPOINTS
+
+#include <time.h>
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define AOJACK_TRACE_PROBES(probe)	\
+	probe(play_entry)		\
+	probe(play_return)		\
+	probe(resample_entry)		\
+	probe(resample_return)		\
+	probe(hungry_entry)		\
+	probe(hungry_return)		\
+	probe(producer_block)		\
+	probe(producer_wake)		\
+	probe(underrun)
+
+#define AOJACK_TRACE_SEMAPHORE(name) aojack_##name##_semaphore
+
+#define AOJACK_TRACE_DECLARE_SEMAPHORE(name) \
+	extern unsigned short AOJACK_TRACE_SEMAPHORE(name);
+AOJACK_TRACE_PROBES(AOJACK_TRACE_DECLARE_SEMAPHORE)
+
+/** Define the semaphores, in a single compilation unit */
+#define AOJACK_TRACE_DEFINE_SEMAPHORE(name) \
+	unsigned short AOJACK_TRACE_SEMAPHORE(name) __attribute__((section(".probes")));
+#define AOJACK_TRACE_DEFINE_SEMAPHORES AOJACK_TRACE_PROBES(AOJACK_TRACE_DEFINE_SEMAPHORE)
+
+#define AOJACK_TRACE_ENABLED(name) __builtin_expect(AOJACK_TRACE_SEMAPHORE(name) != 0, 0)
+
+static inline uint64_t aojack_trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the timer is started only if the probe reporting the duration is enabled */
+#define AOJACK_TRACE_TIMER(t, name) uint64_t t = (AOJACK_TRACE_ENABLED(name) ? aojack_trace_now() : 0)
+#define AOJACK_TRACE_ELAPSED(t) ((t) ? aojack_trace_now() - (t) : 0)
+
+#define AOJACK_TRACE1(name, a) \
+	do { if (AOJACK_TRACE_ENABLED(name)) DTRACE_PROBE1(aojack, name, a); } while (0)
+#define AOJACK_TRACE2(name, a, b) \
+	do { if (AOJACK_TRACE_ENABLED(name)) DTRACE_PROBE2(aojack, name, a, b); } while (0)
+
+#else
+
+#define AOJACK_TRACE_DEFINE_SEMAPHORES
+
+#define AOJACK_TRACE_TIMER(t, name) uint64_t t __attribute__((unused)) = 0
+#define AOJACK_TRACE_ELAPSED(t) 0
+
+#define AOJACK_TRACE1(name, a) do {} while (0)
+#define AOJACK_TRACE2(name, a, b) do {} while (0)
+
+#endif /* AOJACK_TRACEPOINTS */
+
+#endif /* __INCLUDE_AOJACK_TRACE_H__ */